@@ -9,6 +9,76 @@ unsigned stou(char *s){
   return strtoul(s,(char **)NULL,10);
 }
 
+// Parse memory size with optional K, M, or G suffix
+unsigned long long parseMemSize(char *s){
+  char *end;
+  unsigned long long size = strtoull(s,&end,10);
+  bool valid = end != s && s[0] != '-';
+  int shift = 0;
+  if(*end == 'K' || *end == 'k')
+    shift = 10;
+  else if(*end == 'M' || *end == 'm')
+    shift = 20;
+  else if(*end == 'G' || *end == 'g')
+    shift = 30;
+  if(shift > 0){
+    size <<= shift;
+    end++;
+  }
+  if(!valid || *end != '\0' || size == 0){
+    cout << "Expected a positive memory size with optional K, M, or G suffix but found \"" << s << "\", exiting..." << endl;
+    exit(-1);
+  }
+  return size;
+}
+
+// Parse a positive integer option value
+int parsePositiveInt(char *s,const string &what){
+  char *end;
+  errno = 0;
+  long value = strtol(s,&end,10);
+  if(end == s || *end != '\0' || errno == ERANGE || value < 1 || value > INT_MAX){
+    cout << "Expected a positive number of " << what << " but found \"" << s << "\", exiting..." << endl;
+    exit(-1);
+  }
+  return value;
+}
+
+// Parse comma-separated list of distinct seeds
+vector<unsigned int> parseSeeds(char *s){
+  string delim = ",";
+  vector<string> seedTokens = tokenize(to_string(s),delim);
+  vector<unsigned int> seeds;
+  unordered_set<unsigned int> uniqueSeeds;
+  for(vector<string>::iterator it = seedTokens.begin(); it != seedTokens.end(); it++){
+    char *end;
+    unsigned long seed = strtoul(it->c_str(),&end,10);
+    if((*it)[0] == '-' || *end != '\0' || seed > UINT_MAX){
+      cout << "Expected a non-negative integer seed but found \"" << *it << "\", exiting..." << endl;
+      exit(-1);
+    }
+    if(!uniqueSeeds.insert(seed).second){
+      cout << "Seed " << seed << " is given more than once, exiting..." << endl;
+      exit(-1);
+    }
+    seeds.push_back(seed);
+  }
+  if(seeds.empty()){
+    cout << "Expected at least one seed after --seeds, exiting..." << endl;
+    exit(-1);
+  }
+  return seeds;
+}
+
+// Report wall time split into time waiting on output and compute time
+void printTimes(chrono::steady_clock::time_point start,StateNetwork &statenetwork){
+  double totTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  cout << "Time: " << totTime << " s, waiting on output " << statenetwork.ioWaitTime << " s, compute " << totTime - statenetwork.ioWaitTime << " s";
+  if(statenetwork.ioWriteTime > 0.0)
+    cout << " (background writes " << statenetwork.ioWriteTime << " s)";
+  cout << endl;
+}
+
   // Call: trade <seed> <Ntries>
 int main(int argc,char *argv[]){
 
@@ -20,13 +90,18 @@ int main(int argc,char *argv[]){
   cout << endl;
 
   // Parse command input
-  const string CALL_SYNTAX = "Call: ./dangling-lumping [-s <seed>] input_state_network.net output_state_network.net\n";
+  const string CALL_SYNTAX = "Call: ./dangling-lumping [-s <seed>] [--counter-rng] [--mem-limit <bytes>[K|M|G]] [--seeds <seed>,<seed>,...] [--threads <threads>] [--max-history <steps>] input_state_network.net output_state_network.net\n";
   if( argc == 1 ){
     cout << CALL_SYNTAX;
     exit(-1);
   }
 
   unsigned int seed = 1234;
+  bool counterRNG = false;
+  unsigned long long memLimit = 0;
+  vector<unsigned int> seeds;
+  unsigned int Nthreads = thread::hardware_concurrency();
+  int maxHistoryLength = 0;
 
   string inFileName;
   string outFileName;
@@ -42,6 +117,30 @@ int main(int argc,char *argv[]){
       seed = atoi(argv[argNr]);
       argNr++;
     }
+    else if(to_string(argv[argNr]) == "--counter-rng"){
+      counterRNG = true;
+      argNr++;
+    }
+    else if(to_string(argv[argNr]) == "--mem-limit"){
+      argNr++;
+      memLimit = parseMemSize(argv[argNr]);
+      argNr++;
+    }
+    else if(to_string(argv[argNr]) == "--seeds"){
+      argNr++;
+      seeds = parseSeeds(argv[argNr]);
+      argNr++;
+    }
+    else if(to_string(argv[argNr]) == "--max-history"){
+      argNr++;
+      maxHistoryLength = parsePositiveInt(argv[argNr],"history steps");
+      argNr++;
+    }
+    else if(to_string(argv[argNr]) == "--threads"){
+      argNr++;
+      Nthreads = parsePositiveInt(argv[argNr],"threads");
+      argNr++;
+    }
     else{
 
       if(argv[argNr][0] == '-'){
@@ -59,13 +158,44 @@ int main(int argc,char *argv[]){
   }
 
   cout << "Setup:" << endl;
-  cout << "-->Using seed: " << seed << endl;
+  if(seeds.empty())
+    cout << "-->Using seed: " << seed << endl;
+  else
+    cout << "-->Using " << seeds.size() << " seeds, one output per seed" << endl;
+  if(counterRNG)
+    cout << "-->Using counter-based random lumping, independent of iteration order" << endl;
+  if(maxHistoryLength > 0)
+    cout << "-->Will use at most " << maxHistoryLength << " steps of context history for lumping" << endl;
+  if(memLimit > 0)
+    cout << "-->Will split unbatched input into batches within " << memLimit << " bytes" << endl;
   cout << "-->Will read state network from file: " << inFileName << endl;
   cout << "-->Will write processed state network to file: " << outFileName << endl;
 
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
   mt19937 mtRand(seed);
 
-  StateNetwork statenetwork(inFileName,outFileName,mtRand);
+  StateNetwork statenetwork(inFileName,outFileName,mtRand,seed,counterRNG);
+  statenetwork.maxHistoryLength = maxHistoryLength;
+
+  if(!seeds.empty()){
+    // Load once and lump once per seed on the shared network
+    if(memLimit > 0){
+      cout << "--seeds cannot be combined with --mem-limit, exiting..." << endl;
+      exit(-1);
+    }
+    statenetwork.loadStateNetworkBatch();
+    if(statenetwork.keepReading){
+      cout << "--seeds requires a state network without batches, exiting..." << endl;
+      exit(-1);
+    }
+    Nthreads = max(1u,min(Nthreads,static_cast<unsigned int>(seeds.size())));
+    statenetwork.lumpDanglingsEnsemble(seeds,Nthreads);
+    printTimes(start,statenetwork);
+    return 0;
+  }
+
+  if(memLimit > 0)
+    statenetwork.splitIntoBatches(memLimit);
 
   while(statenetwork.loadStateNetworkBatch()){
     statenetwork.lumpDanglings();
@@ -82,6 +212,8 @@ int main(int argc,char *argv[]){
   if(statenetwork.Nbatches > 1)
     statenetwork.compileBatches();
 
+  printTimes(start,statenetwork);
+
 }
 
 
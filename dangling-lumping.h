@@ -1,6 +1,9 @@
 #include <cstdio>
 #include <cmath>
 #include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <cerrno>
 #include <cstring>
 #include <ctime>
 #include <iostream>
@@ -9,9 +12,16 @@
 #include <iomanip>
 #include <random>
 #include <functional>
+#include <algorithm>
 #include <map>
 #include <unordered_map>
 #include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
 using namespace std;
 const double epsilon = 1e-15;
 
@@ -23,6 +33,105 @@ struct my_ofstream : std::ofstream {
   }
 };
 
+// Output stream that formats into a buffer on the calling thread and hands full buffers
+// to a dedicated writer thread, such that formatting and disk writes overlap
+class AsyncWriter{
+public:
+	explicit AsyncWriter(streamsize prec = 15,size_t buffersize = 1 << 22,size_t Nbuffers = 2);
+	~AsyncWriter();
+	void open(const string &filename,ios_base::openmode mode = ios_base::out);
+	void close();
+	template <class T> AsyncWriter& operator<<(const T &t){
+		buffer << t;
+		if(static_cast<size_t>(buffer.tellp()) >= bufferSize)
+			flushBuffer();
+		return *this;
+	}
+	double waitTime = 0.0; // Seconds the calling thread waited for the writer
+	double writeTime = 0.0; // Seconds the writer thread spent writing
+private:
+	void flushBuffer();
+	void writeBuffers();
+	ostringstream buffer;
+	ofstream ofs;
+	thread writer;
+	mutex queueMutex;
+	condition_variable queueCondition;
+	deque<string> queue;
+	size_t bufferSize;
+	size_t Nbuffers;
+	bool writing = false;
+	bool closing = false;
+};
+
+AsyncWriter::AsyncWriter(streamsize prec,size_t buffersize,size_t Nbuffers){
+	buffer.precision(prec);
+	bufferSize = buffersize;
+	this->Nbuffers = Nbuffers;
+}
+
+AsyncWriter::~AsyncWriter(){
+	close();
+}
+
+void AsyncWriter::open(const string &filename,ios_base::openmode mode){
+	close();
+	ofs.open(filename.c_str(),mode);
+	closing = false;
+	writing = true;
+	writer = thread(&AsyncWriter::writeBuffers,this);
+}
+
+void AsyncWriter::close(){
+	if(!writing)
+		return;
+	flushBuffer();
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	{
+		lock_guard<mutex> lock(queueMutex);
+		closing = true;
+	}
+	queueCondition.notify_all();
+	writer.join();
+	waitTime += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	ofs.close();
+	writing = false;
+}
+
+void AsyncWriter::flushBuffer(){
+	if(buffer.tellp() <= 0)
+		return;
+	string data = buffer.str();
+	buffer.str("");
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	unique_lock<mutex> lock(queueMutex);
+	// Wait until the writer has a free buffer
+	queueCondition.wait(lock,[this]{ return queue.size() < Nbuffers; });
+	waitTime += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	queue.push_back(string());
+	queue.back().swap(data);
+	lock.unlock();
+	queueCondition.notify_all();
+}
+
+void AsyncWriter::writeBuffers(){
+	unique_lock<mutex> lock(queueMutex);
+	while(true){
+		queueCondition.wait(lock,[this]{ return !queue.empty() || closing; });
+		if(queue.empty())
+			return;
+		string data;
+		data.swap(queue.front());
+		lock.unlock();
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		ofs.write(data.data(),data.size());
+		writeTime += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		lock.lock();
+		queue.pop_front();
+		queueCondition.notify_all();
+	}
+}
+
 vector<string> tokenize(const string& str,string& delimiters){
 
 	vector<string> tokens;
@@ -49,6 +158,83 @@ vector<string> tokenize(const string& str,string& delimiters){
 
 }
 
+// Counter-based random integer in [0,n) keyed by seed and stateId (SplitMix64 mixing).
+// A pure function of its arguments, so lumping choices do not depend on iteration order.
+inline int counterRandInt(unsigned int seed, int stateId, int n){
+	uint64_t z = (static_cast<uint64_t>(seed) << 32) | static_cast<uint32_t>(stateId);
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	return static_cast<int>(((z >> 32) * static_cast<uint64_t>(n)) >> 32);
+}
+
+// Parse complete numeric tokens and exit on malformed input such as "3q"
+int parseInt(const string &token,const string &line){
+
+	char *end;
+	errno = 0;
+	long value = strtol(token.c_str(),&end,10);
+	if(token.empty() || *end != '\0'){
+		cout << "Expected an integer but found \"" << token << "\" on line \"" << line << "\", exiting..." << endl;
+		exit(-1);
+	}
+	if(errno == ERANGE || value < INT_MIN || value > INT_MAX){
+		cout << "Integer \"" << token << "\" is out of range on line \"" << line << "\", exiting..." << endl;
+		exit(-1);
+	}
+
+	return value;
+
+}
+
+double parseDouble(const string &token,const string &line){
+
+	char *end;
+	double value = strtod(token.c_str(),&end);
+	if(token.empty() || *end != '\0'){
+		cout << "Expected a number but found \"" << token << "\" on line \"" << line << "\", exiting..." << endl;
+		exit(-1);
+	}
+
+	return value;
+
+}
+
+// Check that all tokens from pos are complete integers, without splitting the line, and return their number
+int checkIntTokens(const string &line,string::size_type pos,const string &delimiters){
+
+	int Ntokens = 0;
+	pos = line.find_first_not_of(delimiters,pos);
+	while(string::npos != pos){
+		string::size_type end = line.find_first_of(delimiters,pos);
+		if(string::npos == end)
+			end = line.length();
+		char *parsed;
+		errno = 0;
+		long value = strtol(line.c_str()+pos,&parsed,10);
+		if(parsed != line.c_str()+end || errno == ERANGE || value < INT_MIN || value > INT_MAX)
+			parseInt(line.substr(pos,end-pos),line); // Exits with the malformed token
+		Ntokens++;
+		pos = line.find_first_not_of(delimiters,end);
+	}
+
+	return Ntokens;
+
+}
+
+int readInt(istringstream &ss,const string &line){
+	string token;
+	ss >> token;
+	return parseInt(token,line);
+}
+
+double readDouble(istringstream &ss,const string &line){
+	string token;
+	ss >> token;
+	return parseDouble(token,line);
+}
+
 enum WriteMode { STATENODES, LINKS, CONTEXTS };
 
 template <class T>
@@ -63,11 +249,8 @@ public:
 	StateNode();
 	StateNode(int stateid, int physid, double outweight);
 	int stateId;
-	int updatedStateId;
 	int physId;
-	int prevPhysId;
 	double outWeight;
-	bool active = true;
 	vector<pair<int,double> > links;
 	vector<string> contexts;
 };
@@ -79,7 +262,6 @@ StateNode::StateNode(int stateid, int physid, double outweight){
 	stateId = stateid;
 	physId = physid;
 	outWeight = outweight;
-	prevPhysId = -1;
 }
 
 class PhysNode{
@@ -87,26 +269,176 @@ public:
 	PhysNode();
 	vector<int> stateNodeIndices;
 	vector<int> stateNodeDanglingIndices;
-	unordered_map<int,vector<int> > contextStateNodeIndices;
 
 };
 
 PhysNode::PhysNode(){
 };
 
+// Prefix tree over context histories of non-dangling state nodes. A path starts at the
+// physical node and continues with the most recent prior physical node first, such that
+// shared histories are stored once and the longest match is found in O(history length).
+class ContextTrie{
+public:
+	ContextTrie();
+	void add(int physId,const vector<int> &history,int stateId);
+	void build();
+	int match(int physId,const int *history,int Nsteps,int &contextLength) const;
+	int NstateNodes(int node) const;
+	int stateNode(int node,int i) const;
+	void clear();
+private:
+	int child(int node,int step) const;
+	void buildNode(int node,int begin,int end,int depth);
+	unordered_map<uint64_t,int> children; // (node, step) -> child node
+	vector<pair<int,int> > ranges; // Contexts [begin,end) that share the path to each trie node
+	vector<int> steps; // Physical node followed by history, most recent first, of each context
+	vector<int> contextStarts; // Start of each context in steps, and end of the last context
+	vector<int> stateNodeIds; // Non-dangling state node of each context
+	vector<int> sortedContexts; // Contexts ordered by physical node and history after build
+};
+
+ContextTrie::ContextTrie(){
+	clear();
+}
+
+int ContextTrie::child(int node,int step) const{
+	unordered_map<uint64_t,int>::const_iterator it = children.find((static_cast<uint64_t>(node) << 32) | static_cast<uint32_t>(step));
+	return it == children.end() ? -1 : it->second;
+}
+
+void ContextTrie::add(int physId,const vector<int> &history,int stateId){
+	steps.push_back(physId);
+	steps.insert(steps.end(),history.begin(),history.end());
+	contextStarts.push_back(steps.size());
+	stateNodeIds.push_back(stateId);
+}
+
+void ContextTrie::build(){
+	int Ncontexts = stateNodeIds.size();
+	if(Ncontexts == 0)
+		return;
+
+	// Sort contexts such that all contexts sharing a path to a trie node are consecutive.
+	// Contexts with the same path keep the order in which they were added.
+	sortedContexts.resize(Ncontexts);
+	for(int i=0;i<Ncontexts;i++)
+		sortedContexts[i] = i;
+	stable_sort(sortedContexts.begin(),sortedContexts.end(),[this](int a,int b){
+		return lexicographical_compare(steps.begin()+contextStarts[a],steps.begin()+contextStarts[a+1],steps.begin()+contextStarts[b],steps.begin()+contextStarts[b+1]);
+	});
+
+	buildNode(0,0,Ncontexts,0);
+}
+
+void ContextTrie::buildNode(int node,int begin,int end,int depth){
+	// Sorted contexts [begin,end) share the first depth steps, and contexts without more steps come first
+	int i = begin;
+	while(i < end && contextStarts[sortedContexts[i]+1] - contextStarts[sortedContexts[i]] <= depth)
+		i++;
+	while(i < end){
+		int step = steps[contextStarts[sortedContexts[i]]+depth];
+		int groupBegin = i;
+		while(i < end && steps[contextStarts[sortedContexts[i]]+depth] == step)
+			i++;
+		int childNode = ranges.size();
+		children[(static_cast<uint64_t>(node) << 32) | static_cast<uint32_t>(step)] = childNode;
+		ranges.push_back(make_pair(groupBegin,i));
+		// A single context is matched against its steps directly, without trie nodes
+		if(i - groupBegin > 1)
+			buildNode(childNode,groupBegin,i,depth+1);
+	}
+}
+
+// Returns the trie node with the longest history shared with a non-dangling context, or -1 if none.
+// The physical node alone is not a shared context.
+int ContextTrie::match(int physId,const int *history,int Nsteps,int &contextLength) const{
+	int node = child(0,physId);
+	int contextNode = -1;
+	contextLength = 0;
+	int i = 0;
+	for(;node >= 0 && i<Nsteps;i++){
+		if(ranges[node].second - ranges[node].first == 1)
+			break;
+		node = child(node,history[i]);
+		if(node >= 0){
+			contextNode = node;
+			contextLength = i+1;
+		}
+	}
+	if(node >= 0 && i < Nsteps){
+		// Continue along the steps of the single context of this node
+		int context = sortedContexts[ranges[node].first];
+		int contextEnd = contextStarts[context+1];
+		for(int j=contextStarts[context]+1+i;i<Nsteps && j<contextEnd && steps[j] == history[i];i++,j++){
+			contextNode = node;
+			contextLength = i+1;
+		}
+	}
+	return contextNode;
+}
+
+int ContextTrie::NstateNodes(int node) const{
+	return ranges[node].second - ranges[node].first;
+}
+
+int ContextTrie::stateNode(int node,int i) const{
+	return stateNodeIds[sortedContexts[ranges[node].first + i]];
+}
+
+void ContextTrie::clear(){
+	children = unordered_map<uint64_t,int>();
+	ranges.assign(1,make_pair(0,0)); // Root node
+	steps = vector<int>();
+	contextStarts.assign(1,0);
+	stateNodeIds = vector<int>();
+	sortedContexts = vector<int>();
+}
+
+
+// Lumping of dangling state nodes for one seed, kept separate from the network
+// such that several lumpings can be computed on the same network
+class Lumping{
+public:
+	Lumping(unsigned int seed);
+	unsigned int seed;
+	int NupdatedStateIds = 0;
+	int NphysDanglings = 0;
+	vector<int> NwithContext; // Lumpings per length of matched history
+	int NwithoutContext = 0;
+	unordered_map<int,int> stateNodeIdMapping;
+	int firstStateId = 0; // Updated id of the first remaining state node
+	vector<int> activeStateNodes; // Remaining state nodes in order of updated id
+	vector<pair<int,int> > lumpedStateNodes; // (lumping stateId, lumped stateId) in order of lumping
+};
+
+Lumping::Lumping(unsigned int seed){
+	this->seed = seed;
+}
 
 class StateNetwork{
 private:
-	double calcEntropyRate();
+	double calcEntropyRate() const;
+	int randInt(int stateId,int n,unsigned int seed,mt19937 &rand) const;
+	void calcLumping(Lumping &lumping,mt19937 &rand) const;
+	template <bool HigherOrder> void calcLumping(Lumping &lumping,mt19937 &rand) const;
+	template <bool HigherOrder> int processContexts(vector<string> &contextLines,int firstContext);
+	void printStateNetwork(AsyncWriter &ofs,const Lumping &lumping,double entropyrate) const;
+	void printLumpedStates(AsyncWriter &ofs,const Lumping &lumping,bool relabel) const;
+	string suffixedOutFileName(string suffix,string extension = "") const;
 	bool readLines(string &line,vector<string> &lines);
-	void writeLines(ifstream &ifs_tmp, ofstream &ofs, WriteMode &writeMode, string &line,int &batchNr);
+	void writeLines(ifstream &ifs_tmp, AsyncWriter &ofs, WriteMode &writeMode, string &line,int &batchNr);
 
 	// For all batches
 	string inFileName;
 	string outFileName;
 	string tmpOutFileName;
+	string batchedInFileName;
 	mt19937 &mtRand;
+	unsigned int seed;
+	bool counterRNG;
 	ifstream ifs;
+	size_t writerBufferSize = 1 << 22; // Bytes per output buffer, smaller with a memory limit
   string line = "First line";
   double totWeight = 0.0;
   int updatedStateId = 0;
@@ -127,14 +459,20 @@ private:
 	int Ndanglings = 0;
 	int Ncontexts = 0;
 	int NphysDanglings = 0;
-	unordered_map<int,int> stateNodeIdMapping;
+	Lumping lumping;
 	unordered_map<int,PhysNode> physNodes;
 	unordered_map<int,StateNode> stateNodes;
+	bool higherOrder = false; // Any context with history beyond the prior physical node
+	unordered_map<int,pair<int,int> > danglingHistories; // Start and length of history in danglingHistorySteps
+	vector<int> danglingHistorySteps;
+	ContextTrie contextTrie;
 
 public:
-	StateNetwork(string infilename,string outfilename,mt19937 &mtrand);
+	StateNetwork(string infilename,string outfilename,mt19937 &mtrand,unsigned int seed,bool counterrng);
 	
 	void lumpDanglings();
+	void lumpDanglingsEnsemble(vector<unsigned int> &seeds,unsigned int Nthreads);
+	void splitIntoBatches(unsigned long long memLimit);
 	bool loadStateNetworkBatch();
 	void printStateNetworkBatch();
 	void printStateNetwork();
@@ -142,14 +480,20 @@ public:
 	void compileBatches();
 
 	bool keepReading = true;
+	int maxHistoryLength = 0; // Steps of context history used for lumping, 0 for all
   int Nbatches = 0;
+  double ioWaitTime = 0.0;
+  double ioWriteTime = 0.0;
 
 };
 
-StateNetwork::StateNetwork(string infilename,string outfilename,mt19937 &mtrand) : mtRand(mtrand){
+StateNetwork::StateNetwork(string infilename,string outfilename,mt19937 &mtrand,unsigned int seed,bool counterrng) : mtRand(mtrand), lumping(seed){
 	inFileName = infilename;
+	this->seed = seed;
+	counterRNG = counterrng;
 	outFileName = outfilename;
 	tmpOutFileName = string(outFileName).append("_tmp");
+	batchedInFileName = string(outFileName).append("_batched_tmp");
 	mtRand = mtrand;
   
   // Open state network
@@ -161,15 +505,15 @@ StateNetwork::StateNetwork(string infilename,string outfilename,mt19937 &mtrand)
 
 }
 
-double StateNetwork::calcEntropyRate(){
+double StateNetwork::calcEntropyRate() const{
 	
 	double h = 0.0;
 
-	for(unordered_map<int,StateNode>::iterator it = stateNodes.begin(); it != stateNodes.end(); it++){
-		StateNode &stateNode = it->second;
-		if(stateNode.active){
+	for(unordered_map<int,StateNode>::const_iterator it = stateNodes.begin(); it != stateNodes.end(); it++){
+		const StateNode &stateNode = it->second;
+		if(stateNode.outWeight > epsilon){
 			double H = 0.0;
-			for(vector<pair<int,double> >::iterator it_link = stateNode.links.begin(); it_link != stateNode.links.end(); it_link++){
+			for(vector<pair<int,double> >::const_iterator it_link = stateNode.links.begin(); it_link != stateNode.links.end(); it_link++){
 				double p = it_link->second/stateNode.outWeight;
 				H -= p*log(p);
 			}
@@ -181,23 +525,44 @@ double StateNetwork::calcEntropyRate(){
 
 }
 
-void StateNetwork::lumpDanglings(){
+int StateNetwork::randInt(int stateId,int n,unsigned int seed,mt19937 &rand) const{
 
-	unordered_set<int> physDanglings;
-	int Nlumpings = 0;
+	// Counter-based draw is a pure function of seed and stateId, independent of draw order
+	if(counterRNG)
+		return counterRandInt(seed,stateId,n);
 
-	cout << "Lumping dangling state nodes:" << endl;
+	uniform_int_distribution<int> randInt(0,n-1);
+	return randInt(rand);
+
+}
+
+void StateNetwork::calcLumping(Lumping &lumping,mt19937 &rand) const{
+
+	// Only third- and higher-order networks need context lumping
+	if(higherOrder)
+		calcLumping<true>(lumping,rand);
+	else
+		calcLumping<false>(lumping,rand);
+
+}
+
+template <bool HigherOrder>
+void StateNetwork::calcLumping(Lumping &lumping,mt19937 &rand) const{
+
+	unordered_set<int> physDanglings;
+	int nextStateId = updatedStateId;
+	lumping.firstStateId = updatedStateId;
 
 	// First loop records updated stateIds for lumped state nodes that other state nodes can be lumping to
-	for(unordered_map<int,StateNode>::iterator it = stateNodes.begin(); it != stateNodes.end(); it++){
-		StateNode &stateNode = it->second;
-		PhysNode &physNode = physNodes[stateNode.physId];
+	for(unordered_map<int,StateNode>::const_iterator it = stateNodes.begin(); it != stateNodes.end(); it++){
+		const StateNode &stateNode = it->second;
+		const PhysNode &physNode = physNodes.at(stateNode.physId);
 
 		if(stateNode.outWeight > epsilon){
 			// Record updated stateIds for non-dangling state nodes
-			stateNodeIdMapping[stateNode.stateId] = updatedStateId;
-			stateNode.updatedStateId = updatedStateId;
-			updatedStateId++;
+			lumping.stateNodeIdMapping[stateNode.stateId] = nextStateId;
+			lumping.activeStateNodes.push_back(stateNode.stateId);
+			nextStateId++;
 		}
 		else{
 			// Lump all dangling state nodes into one state node in dangling physical nodes, and update the stateIds
@@ -210,20 +575,19 @@ void StateNetwork::lumpDanglings(){
 				int lumpedStateIndex = physNode.stateNodeDanglingIndices[0];
 				if(lumpedStateIndex == stateNode.stateId){
 					// The first dangling state node in dangling physical node remains
-					stateNodeIdMapping[stateNode.stateId] = updatedStateId;
-					stateNode.updatedStateId = updatedStateId;
-					updatedStateId++;
+					lumping.stateNodeIdMapping[stateNode.stateId] = nextStateId;
+					lumping.activeStateNodes.push_back(stateNode.stateId);
+					nextStateId++;
 				}	
 			}
 		}
 	}
+	lumping.NupdatedStateIds = nextStateId - updatedStateId;
 
 	// Second loop records updated stateIds of lumping state nodes
-	int NwithContext = 0;
-	int NwithoutContext = 0;
-	for(unordered_map<int,StateNode>::iterator it = stateNodes.begin(); it != stateNodes.end(); it++){
-		StateNode &stateNode = it->second;
-		PhysNode &physNode = physNodes[stateNode.physId];
+	for(unordered_map<int,StateNode>::const_iterator it = stateNodes.begin(); it != stateNodes.end(); it++){
+		const StateNode &stateNode = it->second;
+		const PhysNode &physNode = physNodes.at(stateNode.physId);
 
 		if(stateNode.outWeight < epsilon){
 
@@ -236,67 +600,171 @@ void StateNetwork::lumpDanglings(){
 				int lumpedStateIndex = physNode.stateNodeDanglingIndices[0];
 				if(lumpedStateIndex != stateNode.stateId){
 					// All but the first dangling state node in dangling physical node are lumping to the first dangling state node
-					// Add context to lumped state node
-					stateNodes[lumpedStateIndex].contexts.insert(stateNodes[lumpedStateIndex].contexts.begin(),stateNode.contexts.begin(),stateNode.contexts.end());
-					// Record updated state id to point to lumped state node with updated stateId and make it inactive
-					stateNodeIdMapping[stateNode.stateId] = stateNodeIdMapping[stateNodes[lumpedStateIndex].stateId];
-					stateNode.updatedStateId = stateNodes[lumpedStateIndex].stateId;
-					stateNode.active = false;
-					// Number of state nodes reduces by 1
-					NstateNodes--;
-					Nlumpings++;
+					lumping.stateNodeIdMapping[stateNode.stateId] = lumping.stateNodeIdMapping[lumpedStateIndex];
+					lumping.lumpedStateNodes.push_back(make_pair(stateNode.stateId,lumpedStateIndex));
 				}	
 			}
 			else{
 	
 				// When dangling state node can be moved to non-dangling state node
 				int lumpedStateIndex = -1;
-				if(stateNode.prevPhysId >= 0){
-					// Third order. First try context lumping.
-					unordered_map<int,vector<int> >::iterator contextStates_it = physNode.contextStateNodeIndices.find(stateNode.prevPhysId);
-					if(contextStates_it != physNode.contextStateNodeIndices.end()){
-						int NcontextStates = contextStates_it->second.size();
-						uniform_int_distribution<int> randInt(0,NcontextStates-1);
+				unordered_map<int,pair<int,int> >::const_iterator history_it;
+				if(HigherOrder && (history_it = danglingHistories.find(stateNode.stateId)) != danglingHistories.end()){
+					// Third or higher order. First try context lumping with the longest shared history.
+					int contextLength = 0;
+					int contextNode = contextTrie.match(stateNode.physId,danglingHistorySteps.data()+history_it->second.first,history_it->second.second,contextLength);
+					if(contextNode >= 0){
+						int NcontextStates = contextTrie.NstateNodes(contextNode);
 						// Find random state node with shared context
-						lumpedStateIndex = contextStates_it->second[randInt(mtRand)];
-						NwithContext++;
+						lumpedStateIndex = contextTrie.stateNode(contextNode,randInt(stateNode.stateId,NcontextStates,lumping.seed,rand));
+						if(static_cast<int>(lumping.NwithContext.size()) <= contextLength)
+							lumping.NwithContext.resize(contextLength+1,0);
+						lumping.NwithContext[contextLength]++;
 					}
 				}
 				if(lumpedStateIndex < 0){
 					// If no shared context withing physical node
-					uniform_int_distribution<int> randInt(0,NnonDanglings-1);
 					// Find random state node
-					lumpedStateIndex = physNode.stateNodeIndices[randInt(mtRand)];
-					NwithoutContext++;
+					lumpedStateIndex = physNode.stateNodeIndices[randInt(stateNode.stateId,NnonDanglings,lumping.seed,rand)];
+					lumping.NwithoutContext++;
 				}
-				// Add context to lumped state node
-				stateNodes[lumpedStateIndex].contexts.insert(stateNodes[lumpedStateIndex].contexts.begin(),stateNode.contexts.begin(),stateNode.contexts.end());
 				
-				// Update state id to point to lumped state node and make it inactive
-				stateNodeIdMapping[stateNode.stateId] = stateNodeIdMapping[stateNodes[lumpedStateIndex].stateId];
-				stateNode.updatedStateId = stateNodes[lumpedStateIndex].stateId;
-
-				stateNode.active = false;
-				// Number of state nodes reduces by 1
-				NstateNodes--;
-				Nlumpings++;
+				// Update state id to point to lumped state node
+				lumping.stateNodeIdMapping[stateNode.stateId] = lumping.stateNodeIdMapping[lumpedStateIndex];
+				lumping.lumpedStateNodes.push_back(make_pair(stateNode.stateId,lumpedStateIndex));
 	
 			}
 		}
 	}
 
-	NphysDanglings = physDanglings.size();
-	cout << "-->Lumped " << Nlumpings << " dangling state nodes (" << NwithContext << " with second-order context and " << NwithoutContext << " with first-order context)." << endl;
+	lumping.NphysDanglings = physDanglings.size();
+
+}
+
+void StateNetwork::lumpDanglings(){
+
+	cout << "Lumping dangling state nodes:" << endl;
+
+	lumping = Lumping(seed);
+	calcLumping(lumping,mtRand);
+
+	int Nlumpings = lumping.lumpedStateNodes.size();
+	updatedStateId += lumping.NupdatedStateIds;
+	NphysDanglings = lumping.NphysDanglings;
+
+	cout << "-->Lumped " << Nlumpings << " dangling state nodes (";
+	int NcontextLengths = lumping.NwithContext.size();
+	for(int i=1;i<NcontextLengths;i++)
+		if(lumping.NwithContext[i] > 0)
+			cout << lumping.NwithContext[i] << " with order-" << i+1 << " context, ";
+	cout << lumping.NwithoutContext << " with first-order context)." << endl;
 	cout << "-->Found " << NphysDanglings << " dangling physical nodes. Lumped dangling state nodes into a single dangling state node." << endl;
 }
 
+void StateNetwork::lumpDanglingsEnsemble(vector<unsigned int> &seeds,unsigned int Nthreads){
+
+	int Nseeds = seeds.size();
+	vector<double> entropyRates(Nseeds);
+	vector<int> Nlumpings(Nseeds);
+	vector<double> waitTimes(Nseeds);
+	vector<double> writeTimes(Nseeds);
+	vector<double> threadTimes(Nthreads);
+	atomic<int> nextSeedNr(0);
+
+	cout << "Lumping dangling state nodes with " << Nseeds << " seeds in " << Nthreads << " threads:" << endl;
+
+	// Lumping dangling state nodes does not change the entropy rate, same for all seeds
+	double entropyrate = calcEntropyRate()/weight;
+
+	// Each thread lumps and writes the network for one seed at a time on the shared, read-only network
+	vector<thread> threads;
+	for(unsigned int i=0;i<Nthreads;i++){
+		threads.push_back(thread([&,i](){
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			for(int seedNr = nextSeedNr++; seedNr < Nseeds; seedNr = nextSeedNr++){
+				unsigned int seed = seeds[seedNr];
+				mt19937 rand(seed);
+				Lumping lumping(seed);
+				calcLumping(lumping,rand);
+				entropyRates[seedNr] = entropyrate;
+				Nlumpings[seedNr] = lumping.lumpedStateNodes.size();
+				AsyncWriter ofs;
+				ofs.open(suffixedOutFileName(string("_seed").append(to_string(seed))));
+				printStateNetwork(ofs,lumping,entropyRates[seedNr]);
+				ofs.close();
+				waitTimes[seedNr] = ofs.waitTime;
+				writeTimes[seedNr] = ofs.writeTime;
+			}
+			threadTimes[i] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		}));
+	}
+	for(vector<thread>::iterator it = threads.begin(); it != threads.end(); it++)
+		it->join();
+
+	// Summarize entropy rates across seeds
+	string summaryFileName = suffixedOutFileName("_seeds",".txt");
+	my_ofstream ofs;
+	ofs.open(summaryFileName.c_str());
+	double mean = 0.0;
+	double minRate = entropyRates[0];
+	double maxRate = entropyRates[0];
+	ofs << "#seed lumpings entropyRate outFile\n";
+	for(int i=0;i<Nseeds;i++){
+		cout << "-->Seed " << seeds[i] << ": lumped " << Nlumpings[i] << " dangling state nodes, entropy rate " << entropyRates[i] << ", wrote " << suffixedOutFileName(string("_seed").append(to_string(seeds[i]))) << endl;
+		ofs << seeds[i] << " " << Nlumpings[i] << " " << entropyRates[i] << " " << suffixedOutFileName(string("_seed").append(to_string(seeds[i]))) << "\n";
+		mean += entropyRates[i]/Nseeds;
+		minRate = min(minRate,entropyRates[i]);
+		maxRate = max(maxRate,entropyRates[i]);
+	}
+	double var = 0.0;
+	for(int i=0;i<Nseeds;i++)
+		var += (entropyRates[i]-mean)*(entropyRates[i]-mean)/Nseeds;
+	ofs << "# Entropy rate mean: " << mean << "\n";
+	ofs << "# Entropy rate std: " << sqrt(var) << "\n";
+	ofs << "# Entropy rate min: " << minRate << "\n";
+	ofs << "# Entropy rate max: " << maxRate << "\n";
+	cout << "-->Entropy rate across seeds: mean " << mean << ", std " << sqrt(var) << ", min " << minRate << ", max " << maxRate << endl;
+	cout << "-->Wrote summary to " << summaryFileName << endl;
+
+	// Threads wait in parallel, so report output times per thread
+	double totWaitTime = 0.0;
+	double totWriteTime = 0.0;
+	double totThreadTime = 0.0;
+	for(int i=0;i<Nseeds;i++){
+		totWaitTime += waitTimes[i];
+		totWriteTime += writeTimes[i];
+	}
+	for(unsigned int i=0;i<Nthreads;i++)
+		totThreadTime += threadTimes[i];
+	ioWaitTime += totWaitTime/Nthreads;
+	ioWriteTime += totWriteTime/Nthreads;
+	cout << "-->Threads waited on output " << (totThreadTime > 0.0 ? 100.0*totWaitTime/totThreadTime : 0.0) << "% of their time, times below are averages per thread" << endl;
+
+}
+
+string StateNetwork::suffixedOutFileName(string suffix,string extension) const{
+
+	// Insert suffix before file extension of the output file
+	string::size_type extPos = outFileName.rfind('.');
+	string::size_type dirPos = outFileName.rfind('/');
+	if(extPos == string::npos || (dirPos != string::npos && extPos < dirPos))
+		extPos = outFileName.length();
+	if(extension.empty())
+		extension = outFileName.substr(extPos);
+	return outFileName.substr(0,extPos).append(suffix).append(extension);
+
+}
+
 bool StateNetwork::readLines(string &line,vector<string> &lines){
 	
 	while(getline(ifs,line)){
+		// Accept files with CRLF line endings
+		if(!line.empty() && line[line.length()-1] == '\r')
+			line.erase(line.length()-1);
 		if(line[0] == '*'){
 			return true;
 		}
-		else if(line[0] != '=' && line[0] != '#'){
+		else if(!line.empty() && line[0] != '=' && line[0] != '#'){
 			lines.push_back(line);
 		}
 	}
@@ -304,6 +772,269 @@ bool StateNetwork::readLines(string &line,vector<string> &lines){
 	return false; // Reached end of file
 }
 
+void StateNetwork::splitIntoBatches(unsigned long long memLimit){
+
+	// Estimated bytes held while a batch is loaded and processed
+	const unsigned long long allocBytes = 2*sizeof(void*); // Heap allocation overhead
+	const unsigned long long hashNodeBytes = 2*sizeof(void*) + allocBytes; // Next pointer, bucket, and allocation
+	const unsigned long long mappingBytes = sizeof(pair<const int,int>) + hashNodeBytes;
+	const unsigned long long stateBytes = sizeof(pair<const int,StateNode>) + hashNodeBytes + mappingBytes + sizeof(int) + sizeof(string);
+	const unsigned long long linkBytes = sizeof(pair<int,double>) + sizeof(string);
+	const unsigned long long contextBytes = 2*sizeof(string) + 2*allocBytes;
+	// Context trie or dangling history of contexts with history beyond the prior physical node, plus one int per step
+	const unsigned long long historyBytes = 3*sizeof(int) + sizeof(pair<int,int>) + hashNodeBytes + sizeof(pair<const uint64_t,int>);
+	const unsigned long long physBytes = sizeof(pair<const int,PhysNode>) + hashNodeBytes;
+	// Bytes held by the splitter itself, with room for vector growth
+	const unsigned long long splitStateBytes = 2*sizeof(pair<int,int>);
+	const unsigned long long splitPhysBytes = 2*(sizeof(int) + 2*sizeof(unsigned long long) + sizeof(int));
+	// Batch files written to at the same time in one pass over the input
+	const int maxOpenBatches = 64;
+
+	// Output buffers in the filled buffer, its copy, and two queued buffers
+	writerBufferSize = max(static_cast<unsigned long long>(1 << 16),min(static_cast<unsigned long long>(1 << 22),memLimit/64));
+	const unsigned long long writerBytes = 4*writerBufferSize;
+
+	cout << "Estimating memory footprint with limit " << memLimit << " bytes:" << endl;
+
+	// ************************* First pass: footprint per physical node ************************* //
+	ifstream ifs_split(inFileName.c_str());
+	if(!ifs_split){
+		cout << "failed to open \"" << inFileName << "\" exiting..." << endl;
+		exit(-1);
+	}
+	vector<pair<int,int> > stateBatch; // Sorted by state id, physical node index in first pass, batch id in second pass
+	vector<int> physIds;
+	vector<unsigned long long> physFootprint;
+	vector<unsigned long long> physTextBytes; // Output is about as long as the input
+	WriteMode readMode = STATENODES;
+	int NstateSections = 0;
+	bool statesSorted = false;
+	unsigned long long stateLineBytes = 0;
+	string buf;
+	istringstream ss;
+
+	cout << "-->Reading input..." << flush;
+	while(getline(ifs_split,line)){
+		if(!line.empty() && line[line.length()-1] == '\r')
+			line.erase(line.length()-1);
+		if(line.empty() || line[0] == '#' || line[0] == '=')
+			continue;
+		ss.clear();
+		ss.str(line);
+		ss >> buf;
+		if(line[0] == '*'){
+			if(buf == "*States"){
+				readMode = STATENODES;
+				NstateSections++;
+			}
+			else if(buf == "*Links")
+				readMode = LINKS;
+			else if(buf == "*Contexts")
+				readMode = CONTEXTS;
+			if(readMode != STATENODES && !statesSorted){
+				if(NstateSections == 0){
+					cout << "\n--mem-limit expects *States before *Links and *Contexts, exiting..." << endl;
+					exit(-1);
+				}
+				// Index the states to look up their physical nodes by binary search
+				sort(stateBatch.begin(),stateBatch.end());
+				for(vector<pair<int,int> >::iterator it = stateBatch.begin(); it != stateBatch.end(); it++)
+					physIds.push_back(it->second);
+				sort(physIds.begin(),physIds.end());
+				physIds.erase(unique(physIds.begin(),physIds.end()),physIds.end());
+				physFootprint = vector<unsigned long long>(physIds.size(),physBytes);
+				physTextBytes = vector<unsigned long long>(physIds.size(),0);
+				for(vector<pair<int,int> >::iterator it = stateBatch.begin(); it != stateBatch.end(); it++)
+					it->second = lower_bound(physIds.begin(),physIds.end(),it->second) - physIds.begin();
+				statesSorted = true;
+			}
+			continue;
+		}
+		int stateId = parseInt(buf,line);
+		if(readMode == STATENODES){
+			if(statesSorted)
+				continue; // Several state sections, the input is kept as it is
+			stateBatch.push_back(make_pair(stateId,readInt(ss,line)));
+			stateLineBytes += line.length();
+			continue;
+		}
+		vector<pair<int,int> >::iterator state_it = lower_bound(stateBatch.begin(),stateBatch.end(),make_pair(stateId,INT_MIN));
+		if(state_it == stateBatch.end() || state_it->first != stateId)
+			continue;
+		physTextBytes[state_it->second] += line.length();
+		if(readMode == LINKS)
+			physFootprint[state_it->second] += linkBytes + line.length();
+		else{
+			physFootprint[state_it->second] += contextBytes + 2*line.length();
+			int Nsteps = count(line.begin(),line.end(),' ') - 1;
+			if(Nsteps > 1)
+				physFootprint[state_it->second] += historyBytes + Nsteps*sizeof(int);
+		}
+	}
+	cout << "found " << stateBatch.size() << " states." << endl;
+
+	if(NstateSections > 1){
+		cout << "-->Input is already divided into " << NstateSections << " batches, keeping them." << endl;
+		line = "First line";
+		return;
+	}
+	if(!statesSorted){
+		cout << "-->Network has no links or contexts, no batching needed." << endl;
+		line = "First line";
+		return;
+	}
+	unsigned long long avgStateLineBytes = stateLineBytes/stateBatch.size();
+	for(unsigned int i=0;i<stateBatch.size();i++){
+		physFootprint[stateBatch[i].second] += stateBytes + avgStateLineBytes;
+		physTextBytes[stateBatch[i].second] += avgStateLineBytes;
+	}
+	
+	// The splitter index and the state id mapping for the complete network must fit the limit
+	unsigned long long splitFootprint = stateBatch.size()*splitStateBytes + physIds.size()*splitPhysBytes;
+	if(splitFootprint >= memLimit){
+		cout << "-->Memory limit cannot be met: indexing " << stateBatch.size() << " states for splitting needs about " << splitFootprint << " bytes, exiting..." << endl;
+		exit(-1);
+	}
+	unsigned long long globalFootprint = stateBatch.size()*mappingBytes;
+	unsigned long long totTextBytes = 0;
+	for(unsigned int i=0;i<physIds.size();i++)
+		totTextBytes += physTextBytes[i];
+	if(globalFootprint + min(writerBytes,totTextBytes) >= memLimit){
+		cout << "-->Memory limit cannot be met: the state id mapping of " << stateBatch.size() << " states and the output buffers need about " << globalFootprint + min(writerBytes,totTextBytes) << " bytes, exiting..." << endl;
+		exit(-1);
+	}
+	unsigned long long batchLimit = memLimit - globalFootprint;
+
+	// Group physical nodes with all their state nodes into batches that fit the limit
+	vector<int> physBatch(physIds.size());
+	int NsplitBatches = 0;
+	unsigned long long batchFootprint = 0;
+	unsigned long long batchTextBytes = 0;
+	int NoversizedPhysNodes = 0;
+	unsigned long long maxPhysFootprint = 0;
+	for(unsigned int i=0;i<physIds.size();i++){
+		unsigned long long physTotFootprint = physFootprint[i] + min(writerBytes,physTextBytes[i]);
+		if(NsplitBatches == 0 || batchFootprint + physFootprint[i] + min(writerBytes,batchTextBytes + physTextBytes[i]) > batchLimit){
+			NsplitBatches++;
+			batchFootprint = 0;
+			batchTextBytes = 0;
+		}
+		batchFootprint += physFootprint[i];
+		batchTextBytes += physTextBytes[i];
+		physBatch[i] = NsplitBatches-1;
+		if(physTotFootprint > batchLimit)
+			NoversizedPhysNodes++;
+		maxPhysFootprint = max(maxPhysFootprint,physTotFootprint);
+	}
+	for(vector<pair<int,int> >::iterator it = stateBatch.begin(); it != stateBatch.end(); it++)
+		it->second = physBatch[it->second];
+	physBatch = vector<int>();
+	physFootprint = vector<unsigned long long>();
+	physTextBytes = vector<unsigned long long>();
+
+	if(NoversizedPhysNodes > 0)
+		cout << "-->Warning: memory limit cannot be met: " << NoversizedPhysNodes << " physical nodes need more than the " << batchLimit << " bytes left after the state id mapping, up to " << maxPhysFootprint << " bytes, and get a batch of their own." << endl;
+	if(NsplitBatches <= 1){
+		cout << "-->Network fits in memory, no batching needed." << endl;
+		line = "First line";
+		return;
+	}
+	cout << "-->Splitting " << physIds.size() << " physical nodes into " << NsplitBatches << " batches." << endl;
+	physIds = vector<int>();
+
+	// ************************* Second pass: write batches ************************* //
+	// Lines are appended to one file per batch, with at most maxOpenBatches files open in each pass over the input
+	cout << "-->Writing batches to " << batchedInFileName << "..." << flush;
+	const char *sectionLabels[] = {"*States\n","*Links\n","*Contexts\n"};
+	vector<string> batchFileNames(NsplitBatches);
+	for(int i=0;i<NsplitBatches;i++)
+		batchFileNames[i] = batchedInFileName + "_" + to_string(i+1);
+	for(int firstBatchNr = 0; firstBatchNr < NsplitBatches; firstBatchNr += maxOpenBatches){
+		int NpassBatches = min(maxOpenBatches,NsplitBatches-firstBatchNr);
+		vector<ofstream> batchFiles(NpassBatches);
+		for(int i=0;i<NpassBatches;i++){
+			batchFiles[i].open(batchFileNames[firstBatchNr+i].c_str());
+			if(!batchFiles[i]){
+				cout << "failed to open \"" << batchFileNames[firstBatchNr+i] << "\" exiting..." << endl;
+				exit(-1);
+			}
+			batchFiles[i] << "===== " << firstBatchNr+i+1 << "/" << NsplitBatches << " =====\n";
+		}
+
+		bool sectionWritten[3] = {false,false,false};
+		ifs_split.clear();
+		ifs_split.seekg(0);
+		while(getline(ifs_split,line)){
+			if(!line.empty() && line[line.length()-1] == '\r')
+				line.erase(line.length()-1);
+			if(line.empty() || line[0] == '#' || line[0] == '=')
+				continue;
+			if(line[0] == '*'){
+				ss.clear();
+				ss.str(line);
+				ss >> buf;
+				if(buf == "*States")
+					readMode = STATENODES;
+				else if(buf == "*Links")
+					readMode = LINKS;
+				else if(buf == "*Contexts")
+					readMode = CONTEXTS;
+				else
+					continue;
+				sectionWritten[readMode] = true;
+				for(int i=0;i<NpassBatches;i++)
+					batchFiles[i] << sectionLabels[readMode];
+				continue;
+			}
+			size_t idStart = line.find_first_not_of(" \t");
+			size_t idEnd = line.find_first_of(" \t",idStart);
+			int stateId = parseInt(line.substr(idStart,idEnd-idStart),line);
+			vector<pair<int,int> >::iterator state_it = lower_bound(stateBatch.begin(),stateBatch.end(),make_pair(stateId,INT_MIN));
+			int batchNr = (state_it == stateBatch.end() || state_it->first != stateId) ? 0 : state_it->second;
+			if(batchNr >= firstBatchNr && batchNr < firstBatchNr+NpassBatches)
+				batchFiles[batchNr-firstBatchNr] << line << '\n';
+		}
+
+		for(int i=0;i<NpassBatches;i++){
+			for(int j=0;j<3;j++)
+				if(!sectionWritten[j])
+					batchFiles[i] << sectionLabels[j];
+			batchFiles[i].close();
+			if(!batchFiles[i]){
+				cout << "failed to write \"" << batchFileNames[firstBatchNr+i] << "\" exiting..." << endl;
+				exit(-1);
+			}
+		}
+	}
+	stateBatch = vector<pair<int,int> >();
+
+	// Concatenate the batch files in order
+	ofstream ofs(batchedInFileName.c_str());
+	if(!ofs){
+		cout << "failed to open \"" << batchedInFileName << "\" exiting..." << endl;
+		exit(-1);
+	}
+	for(int i=0;i<NsplitBatches;i++){
+		ifstream ifs_batch(batchFileNames[i].c_str());
+		ofs << ifs_batch.rdbuf();
+		ifs_batch.close();
+		remove( batchFileNames[i].c_str() );
+	}
+	ofs.close();
+	if(!ofs){
+		cout << "failed to write \"" << batchedInFileName << "\" exiting..." << endl;
+		exit(-1);
+	}
+	cout << "done!" << endl;
+
+	// Continue reading from the batched network
+	ifs.close();
+	ifs.clear();
+	ifs.open(batchedInFileName.c_str());
+	line = "First line";
+
+}
+
 bool StateNetwork::loadStateNetworkBatch(){
 
 	vector<string> stateLines;
@@ -374,12 +1105,9 @@ bool StateNetwork::loadStateNetworkBatch(){
 
 		ss.clear();
 		ss.str(stateLines[i]);
-		ss >> buf;
-		int stateId = atoi(buf.c_str());
-		ss >> buf;
-		int physId = atoi(buf.c_str());
-	  ss >> buf;
-	  double outWeight = atof(buf.c_str());
+		int stateId = readInt(ss,stateLines[i]);
+		int physId = readInt(ss,stateLines[i]);
+	  double outWeight = readDouble(ss,stateLines[i]);
 	  weight += outWeight;
 		if(outWeight > epsilon)
 			physNodes[physId].stateNodeIndices.push_back(stateId);
@@ -397,35 +1125,21 @@ bool StateNetwork::loadStateNetworkBatch(){
 	for(int i=0;i<Nlinks;i++){
 			ss.clear();
 			ss.str(linkLines[i]);
-			ss >> buf;
-			int source = atoi(buf.c_str());
-			ss >> buf;
-			int target = atoi(buf.c_str());
-			ss >> buf;
-			double linkWeight = atof(buf.c_str());
+			int source = readInt(ss,linkLines[i]);
+			int target = readInt(ss,linkLines[i]);
+			double linkWeight = readDouble(ss,linkLines[i]);
 			stateNodes[source].links.push_back(make_pair(target,linkWeight));
 	}
  	cout << "done!" << endl;
 
 	// Process contexts
 	cout << "-->Processing " << Ncontexts  << " contexts..." << flush;
-	string delim = " ";
-	for(int i=0;i<Ncontexts;i++){
-			vector<string> contextLine = tokenize(contextLines[i],delim);
-			int stateId = atoi(contextLine[0].c_str());
-			if(contextLine.size() > 3){
-				// Third order. Save context for context lumping.
-				int physId = atoi(contextLine[1].c_str());
-				int prevPhysId = atoi(contextLine[2].c_str());	
-				// Add non-dangling state node to lumping context
-				StateNode &stateNode = stateNodes[stateId];
-				stateNode.prevPhysId = prevPhysId; 
-				if(stateNode.outWeight > epsilon)
-					physNodes[physId].contextStateNodeIndices[prevPhysId].push_back(stateId);
-			}
-			
-			string context = contextLines[i].substr(contextLine[0].length()+1);
-			stateNodes[stateId].contexts.push_back(context);
+	// Contexts are processed as first or second order until the first context with longer history
+	int NfirstOrderContexts = processContexts<false>(contextLines,0);
+	higherOrder = NfirstOrderContexts < Ncontexts;
+	if(higherOrder){
+		processContexts<true>(contextLines,NfirstOrderContexts);
+		contextTrie.build();
 	}
 	cout << "done!" << endl;
 
@@ -446,55 +1160,76 @@ bool StateNetwork::loadStateNetworkBatch(){
 
 }
 
+// Processes contexts from firstContext and returns the number of processed contexts.
+// Without HigherOrder, stops at the first context with history beyond the prior physical node.
+template <bool HigherOrder>
+int StateNetwork::processContexts(vector<string> &contextLines,int firstContext){
+
+	string delim = " ";
+	for(int i=firstContext;i<Ncontexts;i++){
+			string &contextLine = contextLines[i];
+			string::size_type stateIdPos = contextLine.find_first_not_of(delim);
+			string::size_type stateIdLength = contextLine.find_first_of(delim,stateIdPos) - stateIdPos;
+			int stateId = parseInt(contextLine.substr(stateIdPos,stateIdLength),contextLine);
+			if(HigherOrder){
+				vector<string> contextTokens = tokenize(contextLine,delim);
+				int NcontextTokens = contextTokens.size();
+				if(NcontextTokens > 3){
+					// Third or higher order. Save history, most recent first, for context lumping.
+					// History beyond maxHistoryLength steps is not used, which bounds the memory of the context trie
+					int physId = parseInt(contextTokens[1],contextLine);
+					int historyLength = NcontextTokens-2;
+					if(maxHistoryLength > 0 && historyLength > maxHistoryLength)
+						historyLength = maxHistoryLength;
+					vector<int> history(historyLength);
+					for(int j=2;j<NcontextTokens;j++){
+						int step = parseInt(contextTokens[j],contextLine);
+						if(j-2 < historyLength)
+							history[j-2] = step;
+					}
+					// Add non-dangling state node to lumping contexts
+					if(stateNodes[stateId].outWeight > epsilon)
+						contextTrie.add(physId,history,stateId);
+					else{
+						danglingHistories[stateId] = make_pair(static_cast<int>(danglingHistorySteps.size()),historyLength);
+						danglingHistorySteps.insert(danglingHistorySteps.end(),history.begin(),history.end());
+					}
+				}
+				else{
+					for(int j=1;j<NcontextTokens;j++)
+						parseInt(contextTokens[j],contextLine);
+				}
+			}
+			else{
+				// Physical node and prior physical node, more tokens continue as higher order
+				if(checkIntTokens(contextLine,stateIdPos+stateIdLength,delim) > 2)
+					return i;
+			}
+
+			stateNodes[stateId].contexts.push_back(contextLine.substr(stateIdLength+1));
+	}
+
+	return Ncontexts;
+
+}
+
 void StateNetwork::printStateNetworkBatch(){
 
-  my_ofstream ofs;
+  AsyncWriter ofs(15,writerBufferSize);
 	if(Nbatches == 1){ // Start with empty file for first batch
-		ofs.open(tmpOutFileName.c_str());
+		ofs.open(tmpOutFileName);
 	}
 	else{ // Append to existing file
-		ofs.open(tmpOutFileName.c_str(),ofstream::app);
+		ofs.open(tmpOutFileName,ofstream::app);
 	}
 	cout << "Writing temporary results to " << tmpOutFileName << ":" << endl;
 
-	cout << "-->Writing " << NstateNodes << " state nodes..." << flush;
-	// To order state nodes by id
-	map<int,int> orderedStateNodeIds;
-	for(unordered_map<int,StateNode>::iterator it = stateNodes.begin(); it != stateNodes.end(); it++){
-		StateNode &stateNode = it->second;
-		if(stateNode.active)
-			orderedStateNodeIds[stateNode.updatedStateId] = stateNode.stateId;
-	}
-
-	ofs << "*States\n";
-	ofs << "#stateId ==> (physicalId, outWeight)\n";
-	for(map<int,int>::iterator it = orderedStateNodeIds.begin(); it != orderedStateNodeIds.end(); it++){
-		StateNode &stateNode = stateNodes[it->second];
-		ofs << stateNode.stateId << " " << stateNode.physId << " " << stateNode.outWeight << "\n";
-	}
-	cout << "done!" << endl;
-
-	cout << "-->Writing " << Nlinks << " links..." << flush;
-	ofs << "*Links\n";
-	ofs << "#(source target) ==> weight\n";
-	for(map<int,int>::iterator it = orderedStateNodeIds.begin(); it != orderedStateNodeIds.end(); it++){
-		StateNode &stateNode = stateNodes[it->second];
-		for(vector<pair<int,double> >::iterator it_link = stateNode.links.begin(); it_link != stateNode.links.end(); it_link++){
-				ofs << stateNode.stateId << " " << it_link->first << " " << it_link->second << "\n";
-		}
-	}
-	cout << "done!" << endl;
-
-	cout << "-->Writing " << Ncontexts << " contexts..." << flush;
-	ofs << "*Contexts \n";
-	ofs << "#stateId <== (physicalId priorId [history...])\n";
-	for(map<int,int>::iterator it = orderedStateNodeIds.begin(); it != orderedStateNodeIds.end(); it++){
-		StateNode &stateNode = stateNodes[it->second];
-		for(vector<string>::iterator it_context = stateNode.contexts.begin(); it_context != stateNode.contexts.end(); it_context++){
-			ofs << stateNode.stateId << " " << (*it_context) << "\n";
-		}
-	}
+	cout << "-->Writing " << NstateNodes - lumping.lumpedStateNodes.size() << " state nodes, " << Nlinks << " links, and " << Ncontexts << " contexts..." << flush;
+	printLumpedStates(ofs,lumping,false);
+	ofs.close();
 	cout << "done!" << endl;
+	ioWaitTime += ofs.waitTime;
+	ioWriteTime += ofs.writeTime;
 
 }
 
@@ -502,59 +1237,85 @@ void StateNetwork::printStateNetwork(){
 
 	entropyRate += calcEntropyRate();
 
-  my_ofstream ofs;
-  ofs.open(outFileName.c_str());
+  AsyncWriter ofs(15,writerBufferSize);
+  ofs.open(outFileName);
  
 	cout << "No more batches, writing results to " << outFileName << ":" << endl;
-	cout << "-->Writing header comments..." << flush;
-  	ofs << "# Physical nodes: " << NphysNodes << "\n";
-  	ofs << "# Dangling physical nodes: " << NphysDanglings << "\n";
-  	ofs << "# State nodes: " << NstateNodes << "\n";
-  	ofs << "# Links: " << Nlinks << "\n";
-  	ofs << "# Contexts: " << Ncontexts << "\n";
-  	ofs << "# Weight: " << weight << "\n";
-  	ofs << "# Entropy rate: " << entropyRate/weight << "\n";	
+	cout << "-->Writing " << NstateNodes - lumping.lumpedStateNodes.size() << " state nodes, " << Nlinks << " links, and " << Ncontexts << " contexts..." << flush;
+	printStateNetwork(ofs,lumping,entropyRate/weight);
+	ofs.close();
 	cout << "done!" << endl;
+	ioWaitTime += ofs.waitTime;
+	ioWriteTime += ofs.writeTime;
 
-	cout << "-->Writing " << NstateNodes << " state nodes..." << flush;
-	// To order state nodes by id
-	map<int,int> orderedStateNodeIds;
-	for(unordered_map<int,StateNode>::iterator it = stateNodes.begin(); it != stateNodes.end(); it++){
-		StateNode &stateNode = it->second;
-		if(stateNode.active)
-			orderedStateNodeIds[stateNode.updatedStateId] = stateNode.stateId;
-	}
+}
+
+void StateNetwork::printStateNetwork(AsyncWriter &ofs,const Lumping &lumping,double entropyrate) const{
+
+	ofs << "# Physical nodes: " << NphysNodes << "\n";
+	ofs << "# Dangling physical nodes: " << lumping.NphysDanglings << "\n";
+	ofs << "# State nodes: " << NstateNodes - lumping.lumpedStateNodes.size() << "\n";
+	ofs << "# Links: " << Nlinks << "\n";
+	ofs << "# Contexts: " << Ncontexts << "\n";
+	ofs << "# Weight: " << weight << "\n";
+	ofs << "# Entropy rate: " << entropyrate << "\n";
+
+	printLumpedStates(ofs,lumping,true);
+
+}
+
+void StateNetwork::printLumpedStates(AsyncWriter &ofs,const Lumping &lumping,bool relabel) const{
 
+	const unordered_map<int,int> &idMapping = lumping.stateNodeIdMapping;
+	const vector<int> &activeStateNodes = lumping.activeStateNodes;
+	int NactiveStateNodes = activeStateNodes.size();
+
+	// Lumping state nodes ordered by the updated id they are lumped into, the last lumped first
+	int Nlumpings = lumping.lumpedStateNodes.size();
+	vector<pair<int,int> > lumpingOrder(Nlumpings);
+	for(int i=0;i<Nlumpings;i++)
+		lumpingOrder[i] = make_pair(idMapping.at(lumping.lumpedStateNodes[i].first),-i);
+	sort(lumpingOrder.begin(),lumpingOrder.end());
+
+	// Write updated state ids, or original state ids to be relabeled when batches are compiled
 	ofs << "*States\n";
 	ofs << "#stateId ==> (physicalId, outWeight)\n";
-	for(map<int,int>::iterator it = orderedStateNodeIds.begin(); it != orderedStateNodeIds.end(); it++){
-		StateNode &stateNode = stateNodes[it->second];
-		ofs << stateNodeIdMapping[stateNode.stateId] << " " << stateNode.physId << " " << stateNode.outWeight << "\n";
+	for(int i=0;i<NactiveStateNodes;i++){
+		const StateNode &stateNode = stateNodes.at(activeStateNodes[i]);
+		ofs << (relabel ? lumping.firstStateId + i : stateNode.stateId) << " " << stateNode.physId << " " << stateNode.outWeight << "\n";
 	}
-	cout << "done!" << endl;
 
-	cout << "-->Writing " << Nlinks << " links..." << flush;
 	ofs << "*Links\n";
 	ofs << "#(source target) ==> weight\n";
-	for(map<int,int>::iterator it = orderedStateNodeIds.begin(); it != orderedStateNodeIds.end(); it++){
-		StateNode &stateNode = stateNodes[it->second];
-		int source = stateNodeIdMapping[stateNode.stateId];
-		for(vector<pair<int,double> >::iterator it_link = stateNode.links.begin(); it_link != stateNode.links.end(); it_link++){
-			ofs << source << " " << stateNodeIdMapping[it_link->first] << " " << it_link->second << "\n";
+	for(int i=0;i<NactiveStateNodes;i++){
+		const StateNode &stateNode = stateNodes.at(activeStateNodes[i]);
+		int stateId = relabel ? lumping.firstStateId + i : stateNode.stateId;
+		for(vector<pair<int,double> >::const_iterator it_link = stateNode.links.begin(); it_link != stateNode.links.end(); it_link++){
+			int target = it_link->first;
+			if(relabel){
+				unordered_map<int,int>::const_iterator target_it = idMapping.find(target);
+				target = target_it == idMapping.end() ? 0 : target_it->second;
+			}
+			ofs << stateId << " " << target << " " << it_link->second << "\n";
 		}
 	}
-	cout << "done!" << endl;
 
-	cout << "-->Writing " << Ncontexts << " contexts..." << flush;
 	ofs << "*Contexts \n";
 	ofs << "#stateId <== (physicalId priorId [history...])\n";
-	for(map<int,int>::iterator it = orderedStateNodeIds.begin(); it != orderedStateNodeIds.end(); it++){
-		StateNode &stateNode = stateNodes[it->second];
-		for(vector<string>::iterator it_context = stateNode.contexts.begin(); it_context != stateNode.contexts.end(); it_context++){
-			ofs << stateNodeIdMapping[stateNode.stateId] << " " << (*it_context) << "\n";
+	vector<pair<int,int> >::const_iterator lumping_it = lumpingOrder.begin();
+	for(int i=0;i<NactiveStateNodes;i++){
+		const StateNode &stateNode = stateNodes.at(activeStateNodes[i]);
+		int stateId = relabel ? lumping.firstStateId + i : stateNode.stateId;
+		// Contexts of lumping state nodes come first, the last lumped first
+		for(;lumping_it != lumpingOrder.end() && lumping_it->first == lumping.firstStateId + i;lumping_it++){
+			const vector<string> &contexts = stateNodes.at(lumping.lumpedStateNodes[-lumping_it->second].first).contexts;
+			for(vector<string>::const_iterator it_context = contexts.begin(); it_context != contexts.end(); it_context++)
+				ofs << stateId << " " << (*it_context) << "\n";
 		}
+		const vector<string> &contexts = stateNode.contexts;
+		for(vector<string>::const_iterator it_context = contexts.begin(); it_context != contexts.end(); it_context++)
+			ofs << stateId << " " << (*it_context) << "\n";
 	}
-	cout << "done!" << endl;
 
 }
 
@@ -565,7 +1326,7 @@ void StateNetwork::concludeBatch(){
 	entropyRate += calcEntropyRate();
 	totWeight += weight;
 	totNphysNodes += NphysNodes;
-	totNstateNodes += NstateNodes;
+	totNstateNodes += NstateNodes - lumping.lumpedStateNodes.size();
 	totNlinks += Nlinks;
 	totNdanglings += Ndanglings;
 	totNcontexts += Ncontexts;
@@ -580,17 +1341,20 @@ void StateNetwork::concludeBatch(){
 
 	cout << "-->Current estimate of the entropy rate: " << entropyRate/totWeight << endl;
 
-	completeStateNodeIdMapping.insert(stateNodeIdMapping.begin(),stateNodeIdMapping.end());
-	stateNodeIdMapping.clear();
+	completeStateNodeIdMapping.insert(lumping.stateNodeIdMapping.begin(),lumping.stateNodeIdMapping.end());
+	lumping = Lumping(seed);
 	physNodes.clear();
 	stateNodes.clear();
+	danglingHistories.clear();
+	danglingHistorySteps = vector<int>();
+	contextTrie.clear();
 
 }
 
 void StateNetwork::compileBatches(){
 
   ifstream ifs_tmp(tmpOutFileName.c_str());
-  my_ofstream ofs;
+  AsyncWriter ofs(15,writerBufferSize);
   ofs.open(outFileName);
   string buf;
 	istringstream ss;
@@ -658,11 +1422,16 @@ void StateNetwork::compileBatches(){
 		}
 	}
 
+	ofs.close();
+	ioWaitTime += ofs.waitTime;
+	ioWriteTime += ofs.writeTime;
+
 	remove( tmpOutFileName.c_str() );
+	remove( batchedInFileName.c_str() );
 
 }
 
-void StateNetwork::writeLines(ifstream &ifs_tmp, ofstream &ofs, WriteMode &writeMode, string &line,int &batchNr){
+void StateNetwork::writeLines(ifstream &ifs_tmp, AsyncWriter &ofs, WriteMode &writeMode, string &line,int &batchNr){
 
 	string buf;
 	istringstream ss;
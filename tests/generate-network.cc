@@ -0,0 +1,50 @@
+// Generate a synthetic state network for regression tests.
+// Call: ./generate-network <Nstates> <order> <seed> > network.net
+// Uses raw mt19937 output, which is the same on all platforms, such that
+// the generated networks and their golden checksums are reproducible.
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+using namespace std;
+
+int main(int argc,char *argv[]){
+
+	if(argc != 4){
+		printf("Call: ./generate-network <Nstates> <order> <seed>\n");
+		exit(-1);
+	}
+
+	int Nstates = atoi(argv[1]);
+	int order = atoi(argv[2]);
+	mt19937 mtRand(atoi(argv[3]));
+	int NphysNodes = Nstates/5 > 2 ? Nstates/5 : 2;
+	const int NpriorPhysNodes = 3; // Few prior physical nodes, such that histories are shared
+	const int outWeights[] = {0,0,1,2,3,4};
+
+	vector<int> physIds(Nstates);
+	vector<int> weights(Nstates);
+
+	printf("*States\n");
+	for(int i=0;i<Nstates;i++){
+		physIds[i] = mtRand() % NphysNodes;
+		weights[i] = outWeights[mtRand() % 6];
+		printf("%d %d %d\n",i,physIds[i],weights[i]);
+	}
+
+	// One link with unit weight per unit of out-weight
+	printf("*Links\n");
+	for(int i=0;i<Nstates;i++)
+		for(int j=0;j<weights[i];j++)
+			printf("%d %d 1\n",i,static_cast<int>(mtRand() % Nstates));
+
+	// History of order-1 prior physical nodes, most recent first
+	printf("*Contexts\n");
+	for(int i=0;i<Nstates;i++){
+		printf("%d %d",i,physIds[i]);
+		for(int j=1;j<order;j++)
+			printf(" %d",static_cast<int>(mtRand() % NpriorPhysNodes));
+		printf("\n");
+	}
+
+}
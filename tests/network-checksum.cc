@@ -0,0 +1,115 @@
+// Checksums of the states, links, and contexts of a lumped state network.
+// Call: ./network-checksum network.net
+// State ids depend on hash map iteration order and batch layout, so each state
+// node is identified by its physical node, out-weight, and sorted contexts instead.
+// Prints one line: <states> <links> <contexts> <entropy rate>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+using namespace std;
+
+string formatNumber(const string &token){
+	char buf[64];
+	snprintf(buf,sizeof(buf),"%.10g",atof(token.c_str()));
+	return string(buf);
+}
+
+// FNV-1a hash of sorted lines
+uint64_t hashLines(vector<string> &lines){
+	sort(lines.begin(),lines.end());
+	uint64_t h = 14695981039346656037ULL;
+	for(vector<string>::iterator it = lines.begin(); it != lines.end(); it++){
+		for(string::iterator c = it->begin(); c != it->end(); c++){
+			h ^= static_cast<unsigned char>(*c);
+			h *= 1099511628211ULL;
+		}
+		h ^= '\n';
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+int main(int argc,char *argv[]){
+
+	if(argc != 2){
+		printf("Call: ./network-checksum network.net\n");
+		exit(-1);
+	}
+
+	ifstream ifs(argv[1]);
+	if(!ifs){
+		printf("failed to open \"%s\" exiting...\n",argv[1]);
+		exit(-1);
+	}
+
+	map<int,string> states; // stateId -> "physId outWeight"
+	map<int,vector<string> > contexts;
+	vector<pair<pair<int,int>,string> > links;
+	string entropyRate = "nan";
+	string line;
+	string section;
+	while(getline(ifs,line)){
+		if(line.empty() || line[0] == '=')
+			continue;
+		if(line[0] == '#'){
+			if(line.compare(0,16,"# Entropy rate: ") == 0)
+				entropyRate = formatNumber(line.substr(16));
+			continue;
+		}
+		istringstream ss(line);
+		string buf;
+		ss >> buf;
+		if(line[0] == '*'){
+			section = buf;
+			continue;
+		}
+		int stateId = atoi(buf.c_str());
+		if(section == "*States"){
+			string physId,outWeight;
+			ss >> physId >> outWeight;
+			states[stateId] = physId + " " + formatNumber(outWeight);
+		}
+		else if(section == "*Links"){
+			string target,weight;
+			ss >> target >> weight;
+			links.push_back(make_pair(make_pair(stateId,atoi(target.c_str())),formatNumber(weight)));
+		}
+		else if(section == "*Contexts"){
+			contexts[stateId].push_back(line.substr(buf.length()+1));
+		}
+	}
+
+	// Label state nodes by content instead of id
+	map<int,string> labels;
+	vector<string> stateLines;
+	vector<string> contextLines;
+	for(map<int,string>::iterator it = states.begin(); it != states.end(); it++){
+		vector<string> &stateContexts = contexts[it->first];
+		sort(stateContexts.begin(),stateContexts.end());
+		string contextLabel;
+		for(vector<string>::iterator it_context = stateContexts.begin(); it_context != stateContexts.end(); it_context++)
+			contextLabel.append(*it_context).append("|");
+		labels[it->first] = it->second + " [" + contextLabel + "]";
+		stateLines.push_back(labels[it->first]);
+		contextLines.push_back(contextLabel);
+	}
+
+	vector<string> linkLines;
+	for(vector<pair<pair<int,int>,string> >::iterator it = links.begin(); it != links.end(); it++){
+		map<int,string>::iterator target_it = labels.find(it->first.second);
+		linkLines.push_back(labels[it->first.first] + " > " + (target_it == labels.end() ? string("?") : target_it->second) + " " + it->second);
+	}
+
+	printf("%016llx %016llx %016llx %s\n",
+		static_cast<unsigned long long>(hashLines(stateLines)),
+		static_cast<unsigned long long>(hashLines(linkLines)),
+		static_cast<unsigned long long>(hashLines(contextLines)),
+		entropyRate.c_str());
+
+}
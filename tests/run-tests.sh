@@ -0,0 +1,118 @@
+#!/bin/sh
+# Regression and determinism tests for dangling-lumping.
+# Call from the repository root: sh tests/run-tests.sh (or make test)
+# Set UPDATE_GOLDEN=1 to rewrite tests/golden.txt after an intended change of output.
+#
+# Golden checksums use --counter-rng, such that the lumping does not depend on
+# hash map iteration order and the checksums are the same on all platforms.
+
+TOOL=./dangling-lumping
+GENERATE=tests/generate-network
+CHECKSUM=tests/network-checksum
+GOLDEN=tests/golden.txt
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+NFAILED=0
+
+fail(){
+  echo "FAILED: $1"
+  NFAILED=$((NFAILED+1))
+}
+
+# run <case> <input> <output> <options...>
+run(){
+  name=$1; in=$2; out=$3; shift 3
+  if ! $TOOL "$@" "$in" "$out" > "$WORK/$name.log"; then
+    fail "$name exited with an error, see output below"
+    tail -5 "$WORK/$name.log"
+  fi
+}
+
+echo "Generating networks..."
+$GENERATE 5000 1 11 > "$WORK/medium_o1.net"
+$GENERATE 5000 3 12 > "$WORK/medium_o3.net"
+$GENERATE 5000 5 13 > "$WORK/medium_o5.net"
+$GENERATE 100000 3 14 > "$WORK/large_o3.net"
+
+echo "Comparing checksums with golden checksums..."
+: > "$WORK/checksums.txt"
+for net in medium_o1 medium_o3 medium_o5; do
+  for seed in 1 2 3; do
+    run ${net}_s$seed "$WORK/$net.net" "$WORK/${net}_s$seed.net" --counter-rng -s $seed
+    echo "${net}_s$seed $($CHECKSUM "$WORK/${net}_s$seed.net")" >> "$WORK/checksums.txt"
+  done
+done
+run medium_o5_h2 "$WORK/medium_o5.net" "$WORK/medium_o5_h2.net" --counter-rng -s 1 --max-history 2
+echo "medium_o5_h2 $($CHECKSUM "$WORK/medium_o5_h2.net")" >> "$WORK/checksums.txt"
+run large_o3_s1 "$WORK/large_o3.net" "$WORK/large_o3_s1.net" --counter-rng -s 1
+echo "large_o3_s1 $($CHECKSUM "$WORK/large_o3_s1.net")" >> "$WORK/checksums.txt"
+
+if [ "$UPDATE_GOLDEN" = "1" ]; then
+  cp "$WORK/checksums.txt" "$GOLDEN"
+  echo "Updated $GOLDEN"
+elif ! diff "$GOLDEN" "$WORK/checksums.txt"; then
+  fail "checksums differ from $GOLDEN (< golden, > actual)"
+fi
+
+echo "Comparing batched and unbatched runs..."
+for net in medium_o1 medium_o3 medium_o5 large_o3; do
+  limits="512K 2M"
+  [ $net = large_o3 ] && limits="4500K 32M" # More than 64 batches and few batches
+  for limit in $limits; do
+    run ${net}_batched "$WORK/$net.net" "$WORK/${net}_batched.net" --counter-rng -s 1 --mem-limit $limit
+    if ! grep -q "batches\.$" "$WORK/${net}_batched.log"; then
+      fail "$net with --mem-limit $limit was not split into batches"
+    fi
+    if [ "$($CHECKSUM "$WORK/${net}_batched.net")" != "$($CHECKSUM "$WORK/${net}_s1.net")" ]; then
+      fail "$net with --mem-limit $limit differs from unbatched run"
+    fi
+  done
+done
+
+$TOOL --mem-limit 32K "$WORK/medium_o1.net" "$WORK/medium_o1_limit.net" > "$WORK/medium_o1_limit.log"
+grep -q "Memory limit cannot be met" "$WORK/medium_o1_limit.log" || fail "unreachable --mem-limit 32K was accepted"
+
+echo "Comparing ensemble and single-seed runs..."
+for net in medium_o1 medium_o5; do
+  run ${net}_ensemble "$WORK/$net.net" "$WORK/${net}_ensemble.net" --seeds 1,2,3 --threads 2
+  run ${net}_ensemble_counter "$WORK/$net.net" "$WORK/${net}_ensemble_counter.net" --counter-rng --seeds 1,2,3 --threads 3
+  for seed in 1 2 3; do
+    run ${net}_mt_s$seed "$WORK/$net.net" "$WORK/${net}_mt_s$seed.net" -s $seed
+    cmp -s "$WORK/${net}_ensemble_seed$seed.net" "$WORK/${net}_mt_s$seed.net" || fail "$net --seeds output for seed $seed differs from -s $seed"
+    cmp -s "$WORK/${net}_ensemble_counter_seed$seed.net" "$WORK/${net}_s$seed.net" || fail "$net --counter-rng --seeds output for seed $seed differs from -s $seed"
+  done
+done
+
+echo "Checking repeated runs..."
+run large_o3_mt_a "$WORK/large_o3.net" "$WORK/large_o3_mt_a.net" -s 5
+run large_o3_mt_b "$WORK/large_o3.net" "$WORK/large_o3_mt_b.net" -s 5
+cmp -s "$WORK/large_o3_mt_a.net" "$WORK/large_o3_mt_b.net" || fail "repeated runs with -s 5 differ"
+
+echo "Checking malformed input..."
+printf '*States\n0 3 1\n1 4 0\n*Links\n0 1 1\n*Contexts\n0 3q 1\n1 4 3\n' > "$WORK/malformed.net"
+$TOOL "$WORK/malformed.net" "$WORK/malformed_out.net" > "$WORK/malformed.log"
+grep -q 'found "3q"' "$WORK/malformed.log" || fail "malformed context token 3q was accepted"
+printf '*States\n0 3 1\n1 4 0\n*Links\n0 1 1\n*Contexts\n0 3 1\n1 4 99999999999\n' > "$WORK/range.net"
+$TOOL "$WORK/range.net" "$WORK/range_out.net" > "$WORK/range.log"
+grep -q 'Integer "99999999999" is out of range' "$WORK/range.log" || fail "out-of-range context token was accepted"
+
+echo "Checking CRLF input..."
+sed 's/$/\r/' "$WORK/medium_o3.net" > "$WORK/medium_o3_crlf.net"
+run medium_o3_crlf "$WORK/medium_o3_crlf.net" "$WORK/medium_o3_crlf_s1.net" --counter-rng -s 1
+[ "$($CHECKSUM "$WORK/medium_o3_crlf_s1.net")" = "$($CHECKSUM "$WORK/medium_o3_s1.net")" ] || fail "CRLF input differs from LF input"
+run medium_o3_crlf_batched "$WORK/medium_o3_crlf.net" "$WORK/medium_o3_crlf_batched.net" --counter-rng -s 1 --mem-limit 512K
+[ "$($CHECKSUM "$WORK/medium_o3_crlf_batched.net")" = "$($CHECKSUM "$WORK/medium_o3_s1.net")" ] || fail "batched CRLF input differs from LF input"
+
+$TOOL --max-history 2x "$WORK/medium_o3.net" "$WORK/history_out.net" > "$WORK/history.log"
+grep -q "Expected a positive number of history steps" "$WORK/history.log" || fail "--max-history 2x was accepted"
+for threads in abc 0 -1 2x; do
+  $TOOL --seeds 1,2 --threads $threads "$WORK/medium_o1.net" "$WORK/threads_out.net" > "$WORK/threads.log"
+  grep -q "Expected a positive number of threads" "$WORK/threads.log" || fail "--threads $threads was accepted"
+done
+
+if [ $NFAILED -gt 0 ]; then
+  echo "$NFAILED test(s) failed."
+  exit 1
+fi
+echo "All tests passed."